@@ -1,41 +1,221 @@
 #include "TSVQ.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <queue>
+
 namespace texture {
 
-TSVQ::TSVQ(const std::vector<std::vector<uchar>> &eigens,
-           const std::vector<Color> &colors)
+namespace {
+
+// Mean of the listed vectors, accumulated in double
+std::vector<float> centroidOf(const std::vector<std::vector<uchar>> &data,
+                              const std::vector<int> &members)
 {
-    _root = new TSVQ_Node();
-    _root->eigens = eigens;
-    _root->colors = colors;
+    if (members.empty()) return {};
 
-    std::vector<TSVQ_Node*> nodes{_root};
-    std::vector<TSVQ_Node*> splited;
+    int dim = data[members[0]].size();
+    std::vector<double> sum(dim, 0.0);
+    for (int i : members) {
+        const std::vector<uchar> &v = data[i];
+        for (int j = 0; j < dim; j++) sum[j] += v[j];
+    }
 
-    int height = log(eigens.size()) / log(2.0);
-    while(height--) {
-        // Update centroid for current nodes
-        for (TSVQ_Node *node : nodes) {
-            node->computeCentroid();
+    double inv_n = 1.0 / members.size();
+    std::vector<float> ret(dim);
+    for (int j = 0; j < dim; j++) ret[j] = float(sum[j] * inv_n);
+    return ret;
+}
+
+// Linear scan of a leaf
+Color nearest(const std::vector<std::vector<uchar>> &eigens, const std::vector<Color> &colors,
+              const std::vector<uchar> &eigen, double &dist)
+{
+    if (eigens.empty()) {
+        dist = std::numeric_limits<double>::max();
+        return Color();
+    }
+
+    int index = 0;
+    dist = distance(eigen, eigens[0]);
+    for (int i = 1, n = eigens.size(); i < n; i++) {
+        double temp = distance(eigen, eigens[i]);
+        if (temp < dist) {
+            index = i;
+            dist = temp;
         }
+    }
+    return colors[index];
+}
+
+};
 
-        // Get splited nodes
-        splited.clear();
-        for (TSVQ_Node* node : nodes) {
-            node->split();
-            if (node->left) splited.push_back(node->left);
-            if (node->right) splited.push_back(node->right);
+TSVQ::TSVQ(std::vector<std::vector<uchar>> eigens,
+           std::vector<Color> colors,
+           int leaf_size, Split mode) :
+    _root(new TSVQ_Node()),
+    _dim(eigens.empty() ? 0 : eigens[0].size()),
+    _resident_used(0)
+{
+    build(_root, eigens, colors, std::max(leaf_size, 1), mode);
+}
+
+TSVQ::TSVQ(int size, const Source &source, const std::string &path,
+           int leaf_size, Split mode) :
+    _root(new TSVQ_Node()),
+    _path(path),
+    _dim(0),
+    _resident_used(0)
+{
+    std::vector<std::vector<uchar>> eigens;
+    std::vector<Color> colors;
+
+    // Top levels from an evenly strided sample
+    {
+        std::vector<std::vector<uchar>> one_eigen;
+        std::vector<Color> one_color;
+        int stride = std::max(1, size / sample_size);
+        for (int i = 0; i < size; i += stride) {
+            source(i, 1, one_eigen, one_color);
+            eigens.push_back(std::move(one_eigen[0]));
+            colors.push_back(std::move(one_color[0]));
         }
-        if (splited.empty()) break;
+    }
+    if (eigens.empty()) return;
+    _dim = eigens[0].size();
 
-        std::swap(splited, nodes);
+    int buckets = std::max(1, (size + bucket_size - 1) / bucket_size);
+    build(_root, eigens, colors,
+          std::max(leaf_size, int(eigens.size()) / buckets), mode);
+
+    // Leaves of the top levels become buckets
+    std::vector<TSVQ_Node*> bucket_nodes;
+    std::unordered_map<const TSVQ_Node*, int> bucket_of;
+    for (std::vector<TSVQ_Node*> stack{ _root }; !stack.empty(); ) {
+        TSVQ_Node *node = stack.back();
+        stack.pop_back();
+        if (node->isLeaf()) {
+            bucket_of[node] = bucket_nodes.size();
+            bucket_nodes.push_back(node);
+        } else {
+            if (node->right) stack.push_back(node->right);
+            if (node->left) stack.push_back(node->left);
+        }
+    }
+    buckets = bucket_nodes.size();
+    debug_print("Out of core build with " << buckets << " buckets");
+
+    auto bucketFile = [&path](int b) { return path + ".bucket" + std::to_string(b); };
+    std::vector<std::string> buffers(buckets);
+    std::vector<int> counts(buckets, 0);
+    std::vector<bool> lost(buckets, false);    // bucket file failed
+    auto flush = [&](int b) {
+        std::ofstream out(bucketFile(b), std::ios::binary | std::ios::app);
+        out.write(buffers[b].data(), buffers[b].size());
+        out.close();
+        if (!out && !lost[b]) {
+            debug_print("Failed to write " << bucketFile(b));
+            lost[b] = true;
+        }
+        buffers[b].clear();
+    };
+    for (int b = 0; b < buckets; b++) {
+        std::remove(bucketFile(b).c_str());
+    }
+
+    // Stream every vector into its bucket on disk
+    for (int begin = 0; begin < size; begin += chunk_size) {
+        int count = std::min(chunk_size, size - begin);
+        source(begin, count, eigens, colors);
+        for (int i = 0; i < count; i++) {
+            int b = bucket_of[descend(_root, eigens[i])];
+            buffers[b].append((const char*)eigens[i].data(), _dim);
+            buffers[b].append((const char*)colors[i].data(), color_size);
+            counts[b]++;
+            if (buffers[b].size() >= flush_bytes) flush(b);
+        }
+    }
+    for (int b = 0; b < buckets; b++) {
+        if (!buffers[b].empty()) flush(b);
+    }
+
+    // Refine one bucket at a time, then page out its leaves.
+    // A bucket left empty or lost to an I/O failure keeps its sample vectors.
+    std::ofstream pages(path + ".pages", std::ios::binary | std::ios::trunc);
+    if (!pages) {
+        debug_print("Failed to open " << path << ".pages, leaves stay in memory");
+    }
+    bool paged = false;
+    for (int b = 0; b < buckets; b++) {
+        TSVQ_Node *bucket = bucket_nodes[b];
+        if (counts[b] > 0 && !lost[b]) {
+            std::ifstream in(bucketFile(b), std::ios::binary);
+            eigens.assign(counts[b], std::vector<uchar>(_dim));
+            colors.assign(counts[b], Color(color_size));
+            for (int i = 0; i < counts[b]; i++) {
+                in.read((char*)eigens[i].data(), _dim);
+                in.read((char*)colors[i].data(), color_size);
+            }
+            if (in) {
+                bucket->eigens.clear();
+                bucket->colors.clear();
+                build(bucket, eigens, colors, std::max(leaf_size, 1), mode);
+            } else {
+                debug_print("Failed to read " << bucketFile(b));
+            }
+        }
+        std::remove(bucketFile(b).c_str());
+
+        if (!pages) continue;
+        for (std::vector<TSVQ_Node*> stack{ bucket }; !stack.empty(); ) {
+            TSVQ_Node *node = stack.back();
+            stack.pop_back();
+            if (!node->isLeaf()) {
+                if (node->right) stack.push_back(node->right);
+                if (node->left) stack.push_back(node->left);
+                continue;
+            }
+            std::streamoff offset = pages.tellp();
+            for (size_t i = 0; i < node->eigens.size(); i++) {
+                pages.write((const char*)node->eigens[i].data(), _dim);
+                pages.write((const char*)node->colors[i].data(), color_size);
+            }
+            // Only a leaf that reached the disk may leave memory
+            if (!pages.flush()) {
+                debug_print("Failed to write " << path << ".pages, leaves stay in memory");
+                break;
+            }
+            node->page_offset = offset;
+            node->page_count = node->eigens.size();
+            paged = paged || node->isPaged();
+            std::vector<std::vector<uchar>>().swap(node->eigens);
+            std::vector<Color>().swap(node->colors);
+        }
+    }
+    pages.close();
+    if (!paged) return;
+    _readers.emplace_back(new std::ifstream(path + ".pages", std::ios::binary));
+    if (!_readers.back()->is_open()) {
+        debug_print("Failed to open " << path << ".pages for reading");
+    }
+    _ASSERT(_readers.back()->is_open());
+}
+
+TSVQ::~TSVQ()
+{
+    if (_root) delete _root;
+    if (!_path.empty()) {
+        _readers.clear();
+        std::remove((_path + ".pages").c_str());
     }
-    
 }
 
-Color TSVQ::bestMatch(const std::vector<uchar>& eigen) const
+const TSVQ::TSVQ_Node* TSVQ::descend(const TSVQ_Node *node, const std::vector<uchar> &eigen)
 {
-    TSVQ_Node *node = _root;
     while (!node->isLeaf()) {
         if (!node->left) node = node->right;
         else if (!node->right) node = node->left;
@@ -44,61 +224,243 @@ Color TSVQ::bestMatch(const std::vector<uchar>& eigen) const
                    node->left : node->right;
         }
     }
-
-    return node->bestMatch(eigen);
+    return node;
 }
 
-void TSVQ::TSVQ_Node::split()
+void TSVQ::build(TSVQ_Node *root, std::vector<std::vector<uchar>> &eigens,
+                 std::vector<Color> &colors, int leaf_size, Split mode)
 {
-    if (eigens.size() == 1) {
-        return;
+    std::vector<int> all(eigens.size());
+    std::iota(all.begin(), all.end(), 0);
+
+    // Nodes still to split, with the vectors they hold
+    std::vector<std::pair<TSVQ_Node*, std::vector<int>>> pending;
+    pending.emplace_back(root, std::move(all));
+    while (!pending.empty()) {
+        TSVQ_Node *node = pending.back().first;
+        std::vector<int> members = std::move(pending.back().second);
+        pending.pop_back();
+
+        node->computeCentroid(eigens, members);
+
+        // Small enough -- keep the vectors in the leaf
+        if ((int)members.size() <= leaf_size) {
+            for (int i : members) {
+                node->eigens.push_back(std::move(eigens[i]));
+                node->colors.push_back(std::move(colors[i]));
+            }
+            continue;
+        }
+
+        std::vector<int> left, right;
+        node->split(eigens, members, left, right, mode);
+        node->left = new TSVQ_Node();
+        node->right = new TSVQ_Node();
+        pending.emplace_back(node->right, std::move(right));
+        pending.emplace_back(node->left, std::move(left));
     }
+}
 
-    // Build new childs
-    left = new TSVQ_Node();
-    right = new TSVQ_Node();
-    left->centroid = centroid * (1 - epsilon);
-    right->centroid = centroid * (1 + epsilon);
+Color TSVQ::bestMatch(const std::vector<uchar>& eigen, int leaves) const
+{
+    // Siblings passed on the way down, nearest first
+    typedef std::pair<double, const TSVQ_Node*> Branch;
+    std::priority_queue<Branch, std::vector<Branch>, std::greater<Branch>> branches;
+    branches.push({ 0.0, _root });
+
+    Color best;
+    double best_dist = std::numeric_limits<double>::max();
+    while (leaves-- > 0 && !branches.empty()) {
+        const TSVQ_Node *node = branches.top().second;
+        branches.pop();
 
-    // Cluster
-    for (int i = 0, n = eigens.size(); i < n; i++) {
-        std::vector<uchar> &v = eigens[i];
-        TSVQ_Node *dst =
-            distance(v, left->centroid) < distance(v, right->centroid) ?
-            left : right;
+        while (!node->isLeaf()) {
+            if (!node->left) node = node->right;
+            else if (!node->right) node = node->left;
+            else {
+                double dist_left = distance(node->left->centroid, eigen);
+                double dist_right = distance(node->right->centroid, eigen);
+                if (dist_left < dist_right) {
+                    branches.push({ dist_right, node->right });
+                    node = node->left;
+                } else {
+                    branches.push({ dist_left, node->left });
+                    node = node->right;
+                }
+            }
+        }
 
-        dst->eigens.push_back(v);
-        dst->colors.push_back(colors[i]);
+        double dist;
+        Color color;
+        if (node->isPaged()) {
+            auto leaf = page(node);
+            color = nearest(leaf->eigens, leaf->colors, eigen, dist);
+        } else {
+            color = node->bestMatch(eigen, dist);
+        }
+        if (dist < best_dist) {
+            best = color;
+            best_dist = dist;
+        }
     }
 
-    // Clear empty nodes
-    if (left->isEmpty()) { delete left; left = nullptr; }
-    if (right->isEmpty()) { delete right; right = nullptr; }
+    return best;
 }
 
-void TSVQ::TSVQ_Node::computeCentroid()
+std::shared_ptr<const TSVQ::Page> TSVQ::page(const TSVQ_Node *node) const
 {
-    int n = eigens.size();
-    if (!n) return;
-    double inv_n = 1.0 / n;
-    centroid = std::vector<uchar>(eigens[0].size(), 0);
-    for (auto v : eigens) {
-        centroid += v * inv_n;
+    // Hit -- no lock, just mark the leaf for the clock hand
+    auto ret = std::atomic_load(&node->resident);
+    if (ret) {
+        node->referenced.store(true, std::memory_order_relaxed);
+        return ret;
+    }
+
+    // Miss -- read with a stream of our own, outside the lock
+    std::unique_ptr<std::ifstream> in;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_readers.empty()) {
+            in = std::move(_readers.back());
+            _readers.pop_back();
+        }
+    }
+    if (!in) in.reset(new std::ifstream(_path + ".pages", std::ios::binary));
+
+    auto page = std::make_shared<Page>();
+    page->eigens.assign(node->page_count, std::vector<uchar>(_dim));
+    page->colors.assign(node->page_count, Color(color_size));
+    in->clear();
+    in->seekg(node->page_offset);
+    for (int i = 0; i < node->page_count; i++) {
+        in->read((char*)page->eigens[i].data(), _dim);
+        in->read((char*)page->colors[i].data(), color_size);
+    }
+    if (!*in) {
+        debug_print("Failed to read the page at " << node->page_offset);
+    }
+    _ASSERT(*in);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _readers.push_back(std::move(in));
+
+    // Another thread may have paged it in meanwhile
+    ret = std::atomic_load(&node->resident);
+    if (ret) return ret;
+    ret = page;
+    std::atomic_store(&node->resident, ret);
+    _resident.push_back(node);
+    _resident_used += pageBytes(node);
+
+    // Evict in clock order, leaves referenced since the last round get another
+    while (_resident_used > resident_bytes && _resident.size() > 1) {
+        const TSVQ_Node *victim = _resident.front();
+        _resident.pop_front();
+        if (victim->referenced.exchange(false, std::memory_order_relaxed)) {
+            _resident.push_back(victim);
+            continue;
+        }
+        _resident_used -= pageBytes(victim);
+        std::atomic_store(&victim->resident, std::shared_ptr<const Page>());
     }
+    return ret;
 }
 
-Color TSVQ::TSVQ_Node::bestMatch(const std::vector<uchar>& eigen) const
+size_t TSVQ::pageBytes(const TSVQ_Node *node) const
 {
-    int index = 0;
-    double dist = distance(eigen, eigens[0]);
-    for (int i = 1, n = eigens.size(); i < n; i++) {
-        double temp = distance(eigen, eigens[i]);
-        if (temp < dist) {
-            index = i;
-            dist = temp;
+    // Vector contents and headers
+    return size_t(node->page_count) * (_dim + color_size + 2 * sizeof(std::vector<uchar>));
+}
+
+void TSVQ::TSVQ_Node::split(const std::vector<std::vector<uchar>> &data,
+                            const std::vector<int> &members,
+                            std::vector<int> &left_members,
+                            std::vector<int> &right_members,
+                            Split mode) const
+{
+    int n = members.size();
+    int dim = centroid.size();
+
+    // Principal axis by power iteration, from the farthest vector
+    std::vector<double> axis(dim, 0.0);
+    {
+        int far = members[0];
+        double far_dist = -1;
+        for (int i : members) {
+            double dist = distance(centroid, data[i]);
+            if (dist > far_dist) {
+                far = i;
+                far_dist = dist;
+            }
+        }
+        for (int j = 0; j < dim; j++) {
+            axis[j] = data[far][j] - centroid[j];
         }
     }
-    return colors[index];
+    std::vector<double> next(dim);
+    for (int iter = 0; iter < power_iterations; iter++) {
+        std::fill(next.begin(), next.end(), 0.0);
+        for (int i : members) {
+            const std::vector<uchar> &v = data[i];
+            double p = 0;
+            for (int j = 0; j < dim; j++) p += (v[j] - centroid[j]) * axis[j];
+            for (int j = 0; j < dim; j++) next[j] += p * (v[j] - centroid[j]);
+        }
+        double norm = 0;
+        for (int j = 0; j < dim; j++) norm += next[j] * next[j];
+        if (norm == 0) break;
+        norm = 1.0 / std::sqrt(norm);
+        for (int j = 0; j < dim; j++) axis[j] = next[j] * norm;
+    }
+
+    // Median along the axis gives two halves of equal size
+    std::vector<std::pair<double, int>> order(n);
+    for (int k = 0; k < n; k++) {
+        const std::vector<uchar> &v = data[members[k]];
+        double p = 0;
+        for (int j = 0; j < dim; j++) p += (v[j] - centroid[j]) * axis[j];
+        order[k] = { p, members[k] };
+    }
+    auto mid = order.begin() + n / 2;
+    std::nth_element(order.begin(), mid, order.end());
+
+    left_members.clear();
+    right_members.clear();
+    for (auto it = order.begin(); it != order.end(); ++it) {
+        (it < mid ? left_members : right_members).push_back(it->second);
+    }
+    if (mode != SPLIT_LLOYD) return;
+
+    // Refine with 2-means. Stop at the last split whose smaller side holds
+    // at least n / lloyd_min_share vectors, which keeps the depth logarithmic.
+    size_t min_side = std::max(1, n / lloyd_min_share);
+    for (int iter = 0; iter < lloyd_iterations; iter++) {
+        std::vector<float> left_centroid = centroidOf(data, left_members);
+        std::vector<float> right_centroid = centroidOf(data, right_members);
+
+        std::vector<int> left, right;
+        for (int i : members) {
+            (distance(left_centroid, data[i]) < distance(right_centroid, data[i]) ?
+             left : right).push_back(i);
+        }
+        if (std::min(left.size(), right.size()) < min_side) break;
+
+        bool converged = left == left_members;
+        std::swap(left, left_members);
+        std::swap(right, right_members);
+        if (converged) break;
+    }
+}
+
+void TSVQ::TSVQ_Node::computeCentroid(const std::vector<std::vector<uchar>> &data,
+                                      const std::vector<int> &members)
+{
+    centroid = centroidOf(data, members);
+}
+
+Color TSVQ::TSVQ_Node::bestMatch(const std::vector<uchar>& eigen, double &dist) const
+{
+    return nearest(eigens, colors, eigen, dist);
 }
 
 };
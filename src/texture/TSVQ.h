@@ -1,5 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #ifdef SHUZIXI_DEBUG
@@ -22,85 +30,142 @@ typedef unsigned char uchar;
 typedef std::vector<uchar> Color;
 
 class TSVQ {
+public:
+    // How a node is split in two
+    enum Split {
+        SPLIT_MEDIAN,   // median along the principal axis, balanced
+        SPLIT_LLOYD,    // median split refined by 2-means iterations
+    };
+
 private:
+    // Vectors of a paged leaf, once read back
+    struct Page {
+        std::vector<std::vector<uchar>> eigens;
+        std::vector<Color> colors;
+    };
+
     class TSVQ_Node {
     public:
         TSVQ_Node *left;
         TSVQ_Node *right;
 
-        std::vector<uchar> centroid;
-        std::vector<std::vector<uchar>> eigens;
-        std::vector<Color> colors;
+        std::vector<float> centroid;
+        std::vector<std::vector<uchar>> eigens;     // leaves only
+        std::vector<Color> colors;                  // leaves only
 
-        TSVQ_Node() : left(nullptr), right(nullptr) {}
+        // Leaves paged out to disk, resident while paged in
+        std::streamoff page_offset;
+        int page_count;
+        mutable std::shared_ptr<const Page> resident;   // atomic access only
+        mutable std::atomic<bool> referenced;           // since the clock hand passed
+
+        TSVQ_Node() : left(nullptr), right(nullptr), page_offset(0), page_count(0),
+                      referenced(false) {}
         ~TSVQ_Node() {
             if (left) delete left;
             if (right) delete right;
         }
 
         bool isLeaf() const { return !left && !right; }
-        bool isEmpty() const { return eigens.empty() || colors.empty(); }
+        bool isPaged() const { return page_count > 0; }
 
-        // Build method
-        void split();
-        void computeCentroid();
+        // Build method, on the vectors listed in members
+        void split(const std::vector<std::vector<uchar>> &data, const std::vector<int> &members,
+                   std::vector<int> &left_members, std::vector<int> &right_members,
+                   Split mode) const;
+        void computeCentroid(const std::vector<std::vector<uchar>> &data,
+                             const std::vector<int> &members);
 
         // Access method
-        Color bestMatch(const std::vector<uchar> &eigen) const;
+        Color bestMatch(const std::vector<uchar> &eigen, double &dist) const;
     };
 
+
+public:
+    // Fills eigens and colors with vectors [begin, begin + count)
+    typedef std::function<void(int begin, int count,
+                               std::vector<std::vector<uchar>> &eigens,
+                               std::vector<Color> &colors)> Source;
+
+    constexpr static int default_leaf_size = 16;
+    constexpr static Split default_split = SPLIT_LLOYD;
+
 private:
-    constexpr static double epsilon = 0.001;
+    constexpr static int power_iterations = 3;
+    constexpr static int lloyd_iterations = 3;
+    constexpr static int lloyd_min_share = 4;     // smaller side >= 1 / this
+
+    // Out of core build
+    constexpr static int sample_size = 1 << 16;     // vectors for the top levels
+    constexpr static int bucket_size = 1 << 18;     // vectors per leaf bucket
+    constexpr static int chunk_size = 1 << 14;      // vectors streamed at once
+    constexpr static size_t flush_bytes = 1 << 20;  // bucket write buffer
+    constexpr static int color_size = 3;
+    constexpr static size_t resident_bytes = size_t(1) << 28;  // paged in leaves
 
 private:
     TSVQ_Node *_root;
 
+    // Paged leaves, unused if everything is in memory
+    std::string _path;
+    int _dim;
+    mutable std::vector<std::unique_ptr<std::ifstream>> _readers;  // idle, on the pages file
+    mutable std::deque<const TSVQ_Node*> _resident;    // paged in leaves, clock order
+    mutable size_t _resident_used;  // in bytes
+    mutable std::mutex _mutex;      // guards readers and resident, not the reads
+
 public:
-    TSVQ(const std::vector<std::vector<uchar>> &eigens, const std::vector<Color> &colors);
-    ~TSVQ() { if(_root) delete _root; }
+    // Nodes are split until they hold at most leaf_size vectors,
+    // the vectors are moved into the leaves
+    TSVQ(std::vector<std::vector<uchar>> eigens, std::vector<Color> colors,
+         int leaf_size = default_leaf_size, Split mode = default_split);
 
-    Color bestMatch(const std::vector<uchar> &eigen) const;
-};
+    // Out of core build for very large exemplars. Vectors are streamed
+    // from source, the top levels are built from a sample and the rest is
+    // refined bucket by bucket. Leaves live in path + ".pages" and are
+    // paged in on demand.
+    TSVQ(int size, const Source &source, const std::string &path,
+         int leaf_size = default_leaf_size, Split mode = default_split);
 
-// Operators
+    ~TSVQ();
 
-inline std::vector<uchar> operator*(const std::vector<uchar> &v, double k) {
-    int n = v.size();
-    std::vector<uchar> ret(n);
-    for (int i = 0; i < n; i++) {
-        ret[i] = v[i] * k;
-    }
-    return ret;
-}
+    TSVQ(const TSVQ&) = delete;
+    TSVQ& operator=(const TSVQ&) = delete;
 
-inline std::vector<uchar> operator*(double k, const std::vector<uchar> &v) {
-    return v * k;
-}
+    // Whether the leaves are paged from disk
+    bool outOfCore() const { return !_path.empty(); }
 
-inline std::vector<uchar> operator+(const std::vector<uchar> &a, const std::vector<uchar> &b) {
-    _ASSERT(a.size() == b.size());
-    int n = a.size();
-    std::vector<uchar> ret(n);
-    for (int i = 0; i < n; i++) {
-        ret[i] = a[i] * b[i];
-    }
-    return ret;
-}
+    // Search effort grows with the number of leaves visited,
+    // 1 -- plain tree descent
+    Color bestMatch(const std::vector<uchar> &eigen, int leaves = 1) const;
+
+private:
+    std::shared_ptr<const Page> page(const TSVQ_Node *node) const;
+    size_t pageBytes(const TSVQ_Node *node) const;
+
+    static const TSVQ_Node* descend(const TSVQ_Node *node, const std::vector<uchar> &eigen);
+    // Leaves take their vectors out of eigens and colors
+    static void build(TSVQ_Node *root, std::vector<std::vector<uchar>> &eigens,
+                      std::vector<Color> &colors, int leaf_size, Split mode);
+};
 
-inline std::vector<uchar>& operator+=(std::vector<uchar> &a, const std::vector<uchar> &b) {
+// Operators
+
+inline double distance(const std::vector<uchar>& a, const std::vector<uchar>& b) {
     _ASSERT(a.size() == b.size());
-    int n = a.size();
-    for (int i = 0; i < n; i++) {
-        a[i] += b[i];
+    double dist = 0;
+    for (int i = 0, n = a.size(); i < n; i++) {
+        dist += (a[i] - b[i]) * (a[i] - b[i]);
     }
-    return a;
+    return dist;
 }
 
-inline double distance(const std::vector<uchar>& a, const std::vector<uchar>& b) {
+inline double distance(const std::vector<float>& a, const std::vector<uchar>& b) {
     _ASSERT(a.size() == b.size());
     double dist = 0;
     for (int i = 0, n = a.size(); i < n; i++) {
-        dist += (a[i] - b[i]) * (a[i] - b[i]);
+        double d = a[i] - b[i];
+        dist += d * d;
     }
     return dist;
 }
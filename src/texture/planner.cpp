@@ -0,0 +1,233 @@
+#include "planner.h"
+#include <texture/pyramid.h>
+#include <texture/quilting.h>
+#include <texture/texture.h>
+
+#include <cmath>
+
+namespace texture {
+
+namespace {
+
+inline double log2n(double n) {
+    return std::max(1.0, std::log2(n));
+}
+
+};
+
+Planner::Planner() :
+    _setup_cost(5e-8),
+    _show_cost(5e-7),
+    _quilting_cost(2e-8)
+{
+    for (int k = 0; k < max_levels; k++) {
+        _build_cost[0][k] = 5e-9;
+        _build_cost[1][k] = 2e-8;
+        _search_cost[k] = 2e-9;
+    }
+}
+
+Plan Planner::fixed(int method, int levels, int neighbor) const
+{
+    return { method, levels, neighbor, TSVQ::default_leaf_size, TSVQ::default_split,
+             std::vector<int>(levels, 1), 0.0 };
+}
+
+Plan Planner::plan(int method, int in_rows, int in_cols, int out_rows, int out_cols,
+                   int levels, int neighbor, double budget) const
+{
+    Plan ret = fixed(method, levels, neighbor);
+    ret.budget = budget;
+    if (method != PIXEL_TSVQ || budget <= 0) return ret;
+
+    // Keep as many levels as possible, shrink the neighborhood first
+    for (int l = levels; l >= 1; l--) {
+        for (int n = neighbor; n >= 3; n -= 2) {
+            Plan candidate = fixed(PIXEL_TSVQ, l, n);
+            candidate.budget = budget;
+            double cost = estimate(candidate, in_rows, in_cols, out_rows, out_cols);
+            if (cost > budget) continue;
+
+            // Spend the rest on search effort, coarse levels are cheap
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (int k = l - 1; k >= 0; k--) {
+                    int leaves = candidate.leaves[k];
+                    if (leaves >= max_leaves) continue;
+                    double more =
+                        estimateLevel(k, candidate, in_rows, in_cols, out_rows, out_cols);
+                    candidate.leaves[k] = leaves * 2;
+                    more = estimateLevel(k, candidate, in_rows, in_cols, out_rows, out_cols) - more;
+                    if (cost + more <= budget) {
+                        cost += more;
+                        changed = true;
+                    } else {
+                        candidate.leaves[k] = leaves;
+                    }
+                }
+            }
+            return candidate;
+        }
+    }
+
+    // Nothing fits, fall back to the fastest backend
+    Plan tsvq = fixed(PIXEL_TSVQ, 1, 3);
+    Plan quilting = fixed(PATCH_QUILTING, levels, neighbor);
+    tsvq.budget = quilting.budget = budget;
+    return estimate(quilting, in_rows, in_cols, out_rows, out_cols) <
+           estimate(tsvq, in_rows, in_cols, out_rows, out_cols) ? quilting : tsvq;
+}
+
+void Planner::adjust(Plan& plan, int k, double elapsed,
+                     int in_rows, int in_cols, int out_rows, int out_cols) const
+{
+    if (plan.method != PIXEL_TSVQ || plan.budget <= 0) return;
+    double left = plan.budget - elapsed;
+
+    // Levels k-1 .. 0 are still to run
+    double cost = 0;
+    while (true) {
+        cost = 0;
+        int widest = -1;
+        for (int i = k - 1; i >= 0; i--) {
+            cost += estimateLevel(i, plan, in_rows, in_cols, out_rows, out_cols);
+            if (plan.leaves[i] > 1 && (widest < 0 || plan.leaves[i] > plan.leaves[widest])) {
+                widest = i;
+            }
+        }
+        if (cost <= left || widest < 0) break;
+        plan.leaves[widest] /= 2;
+    }
+    if (cost <= left) return;
+
+    // Even one leaf is too slow, keep the levels that fit in order and
+    // drop the rest. Showing the result once is always paid for.
+    double spent = _show_cost * out_rows * out_cols;
+    for (int i = k - 1; i >= 0; i--) {
+        spent += estimateLevel(i, plan, in_rows, in_cols, out_rows, out_cols);
+        if (plan.leaves[i] == 0 || spent > left) {
+            std::fill(plan.leaves.begin(), plan.leaves.begin() + i + 1, 0);
+            break;
+        }
+    }
+}
+
+void Planner::recordSetup(int out_rows, int out_cols, double s)
+{
+    double units = double(out_rows) * out_cols;
+    if (units <= 0 || s <= 0) return;
+    _setup_cost = (1 - smoothing) * _setup_cost + smoothing * s / units;
+}
+
+void Planner::recordShow(int out_rows, int out_cols, double s)
+{
+    double units = double(out_rows) * out_cols;
+    if (units <= 0 || s <= 0) return;
+    _show_cost = (1 - smoothing) * _show_cost + smoothing * s / units;
+}
+
+void Planner::recordBuild(int k, const Plan& plan, int in_rows, int in_cols,
+                          bool out_of_core, double s)
+{
+    double units = buildUnits(k, plan, in_rows, in_cols);
+    if (units <= 0 || s <= 0) return;
+    double &cost = _build_cost[out_of_core][slot(k)];
+    cost = (1 - smoothing) * cost + smoothing * s / units;
+}
+
+void Planner::recordSearch(int k, const Plan& plan,
+                           int in_rows, int in_cols, int out_rows, int out_cols, double s)
+{
+    double units = searchUnits(k, plan, in_rows, in_cols, out_rows, out_cols);
+    if (units <= 0 || s <= 0) return;
+    double &cost = _search_cost[slot(k)];
+    cost = (1 - smoothing) * cost + smoothing * s / units;
+}
+
+void Planner::recordQuilting(int neighbor, int in_rows, int in_cols,
+                             int out_rows, int out_cols, double s)
+{
+    double units = quiltingUnits(neighbor, in_rows, in_cols, out_rows, out_cols);
+    if (units <= 0 || s <= 0) return;
+    _quilting_cost = (1 - smoothing) * _quilting_cost + smoothing * s / units;
+}
+
+double Planner::estimate(const Plan& plan, int in_rows, int in_cols,
+                         int out_rows, int out_cols) const
+{
+    if (plan.method == PATCH_QUILTING) {
+        return _quilting_cost *
+            quiltingUnits(plan.neighbor, in_rows, in_cols, out_rows, out_cols);
+    }
+
+    double ret = _setup_cost * out_rows * out_cols;
+    for (int k = 0; k < plan.levels; k++) {
+        ret += estimateLevel(k, plan, in_rows, in_cols, out_rows, out_cols);
+    }
+    return ret;
+}
+
+double Planner::estimateLevel(int k, const Plan& plan, int in_rows, int in_cols,
+                              int out_rows, int out_cols) const
+{
+    // Every level shows all output pixels, a dropped one only if it is the last
+    double show = _show_cost * out_rows * out_cols;
+    if (plan.leaves[k] == 0) return k == 0 ? show : 0.0;
+
+    return show
+        + _build_cost[outOfCore(k, plan, in_rows, in_cols)][slot(k)]
+            * buildUnits(k, plan, in_rows, in_cols)
+        + _search_cost[slot(k)] * searchUnits(k, plan, in_rows, in_cols, out_rows, out_cols);
+}
+
+int Planner::eigenSize(int k, int levels, int neighbor)
+{
+    // Causal part at level k, full neighborhoods at coarser levels
+    int half = neighbor >> 1;
+    int size = half * neighbor + half;
+    for (int level = k + 1; level < levels; level++) {
+        neighbor = (neighbor + 1) >> 1;
+        size += neighbor * neighbor;
+    }
+    return 3 * size;
+}
+
+bool Planner::outOfCore(int k, const Plan& plan, int in_rows, int in_cols)
+{
+    size_t n = size_t(in_rows >> k) * (in_cols >> k);
+    return Pyramid::outOfCore(n, eigenSize(k, plan.levels, plan.neighbor));
+}
+
+double Planner::buildUnits(int k, const Plan& plan, int in_rows, int in_cols)
+{
+    // Every split pass touches all vectors
+    double n = double(in_rows >> k) * (in_cols >> k);
+    return n * eigenSize(k, plan.levels, plan.neighbor) * log2n(n);
+}
+
+double Planner::searchUnits(int k, const Plan& plan,
+                            int in_rows, int in_cols, int out_rows, int out_cols)
+{
+    // Descent through the tree, then every further leaf costs a scan of
+    // its vectors and a partial descent from the sibling it was queued at
+    double n = double(in_rows >> k) * (in_cols >> k);
+    double m = double(out_rows >> k) * (out_cols >> k);
+    double leaf = outOfCore(k, plan, in_rows, in_cols) ?
+        std::max(plan.leaf_size, int(Pyramid::paged_leaf_size)) : plan.leaf_size;
+    double depth = log2n(n / leaf);
+    return m * eigenSize(k, plan.levels, plan.neighbor) * (depth + plan.leaves[k] * (leaf + depth));
+}
+
+double Planner::quiltingUnits(int neighbor, int in_rows, int in_cols,
+                              int out_rows, int out_cols)
+{
+    // One DFT based overlap search over the exemplar per patch
+    int patch = Quilting::patchSize(neighbor);
+    int step = std::max(1, patch - Quilting::overlapSize(patch));
+    double patches = double((out_rows + step - 1) / step) * ((out_cols + step - 1) / step);
+    double n = double(in_rows) * in_cols;
+    return patches * n * log2n(n);
+}
+
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <texture/TSVQ.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace texture {
+
+// Parameters of one synthesis request
+struct Plan
+{
+    int method;
+    int levels;
+    int neighbor;
+    int leaf_size;              // TSVQ build
+    TSVQ::Split split;
+    std::vector<int> leaves;    // TSVQ leaves visited, per level,
+                                // 0 -- level dropped, upsampled from the coarser one
+    double budget;              // in seconds, 0 -- unbounded
+};
+
+// Picks parameters that fit a time budget.
+//
+// Cost is estimated from exemplar size, output size and neighborhood
+// dimension, scaled by throughput measured on earlier runs. The whole
+// run counts: setup and UI updates per output pixel, tree builds and
+// searches per level.
+class Planner
+{
+private:
+    constexpr static int max_leaves = 16;
+    constexpr static int max_levels = 8;        // separate history, deeper ones share
+    constexpr static double smoothing = 0.5;    // weight of the newest sample
+
+private:
+    // Seconds per unit of work, see the estimate functions
+    double _setup_cost;
+    double _show_cost;
+    double _build_cost[2][max_levels];  // in core, out of core
+    double _search_cost[max_levels];
+    double _quilting_cost;
+
+public:
+    Planner();
+
+    // Plan that runs the given parameters as they are
+    Plan fixed(int method, int levels, int neighbor) const;
+
+    // Best plan within budget, levels and neighbor act as upper bounds
+    Plan plan(int method, int in_rows, int in_cols, int out_rows, int out_cols,
+              int levels, int neighbor, double budget) const;
+
+    // After finishing level k at elapsed seconds, cut search effort
+    // of the remaining levels if they would overrun the budget, and
+    // drop the levels that don't fit even with one leaf
+    void adjust(Plan& plan, int k, double elapsed,
+                int in_rows, int in_cols, int out_rows, int out_cols) const;
+
+    // Timing history
+    void recordSetup(int out_rows, int out_cols, double s);
+    void recordShow(int out_rows, int out_cols, double s);
+    void recordBuild(int k, const Plan& plan, int in_rows, int in_cols,
+                     bool out_of_core, double s);
+    void recordSearch(int k, const Plan& plan,
+                      int in_rows, int in_cols, int out_rows, int out_cols, double s);
+    void recordQuilting(int neighbor, int in_rows, int in_cols,
+                        int out_rows, int out_cols, double s);
+
+    // Estimated seconds
+    double estimate(const Plan& plan, int in_rows, int in_cols,
+                    int out_rows, int out_cols) const;
+    double estimateLevel(int k, const Plan& plan, int in_rows, int in_cols,
+                         int out_rows, int out_cols) const;
+
+    // Length of the eigen vector at level k
+    static int eigenSize(int k, int levels, int neighbor);
+
+private:
+    static int slot(int k) { return std::min(k, max_levels - 1); }
+    static bool outOfCore(int k, const Plan& plan, int in_rows, int in_cols);
+
+    static double buildUnits(int k, const Plan& plan, int in_rows, int in_cols);
+    static double searchUnits(int k, const Plan& plan,
+                              int in_rows, int in_cols, int out_rows, int out_cols);
+    static double quiltingUnits(int neighbor, int in_rows, int in_cols,
+                                int out_rows, int out_cols);
+};
+
+};
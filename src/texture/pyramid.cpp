@@ -12,6 +12,15 @@ Pyramid::Pyramid(const cv::Mat& img, int k, int neighbor):
     }
 }
 
+Pyramid::Pyramid(const std::vector<cv::Mat>& levels, int neighbor):
+    _pyramid(levels.size()), _neighbor(neighbor)
+{
+    // Each level must be half the size of the previous one
+    for (int i = 0, n = levels.size(); i < n; i++) {
+        _pyramid[i] = levels[i].clone();
+    }
+}
+
 void Pyramid::setColor(Color color, int row, int col, int k)
 {
     cv::Mat &img = _pyramid[k];
@@ -35,27 +44,71 @@ std::vector<std::pair<int, int> > Pyramid::range(int row, int col, int k) const
     return ret;
 }
 
-TSVQ* Pyramid::tree(int k) const
+TSVQ* Pyramid::tree(int k, const std::string &swap,
+                     int leaf_size, TSVQ::Split mode) const
 {
-    int rows = _pyramid[k].rows;
-    int cols = _pyramid[k].cols;
-    int size = rows * cols;
-    std::vector<std::vector<uchar>> eigens(size);
-    std::vector<Color> colors(size);
+    return buildTree(k, swap, false, leaf_size, mode);
+}
 
-    int pos = 0;
-    int index = 0;
-    const uchar* data = _pyramid[k].ptr<uchar>(0);
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            eigens[pos] = eigenAt(i, j, k);
-            colors[pos] = { data[index], data[index + 1], data[index + 2]};
-            pos++;
-            index += 3;
-        }
+TSVQ* Pyramid::fullTree(int k, const std::string &swap,
+                         int leaf_size, TSVQ::Split mode) const
+{
+    return buildTree(k, swap, true, leaf_size, mode);
+}
+
+TSVQ* Pyramid::buildTree(int k, const std::string &swap, bool full,
+                          int leaf_size, TSVQ::Split mode) const
+{
+    int size = _pyramid[k].rows * _pyramid[k].cols;
+    size_t dim = full ? fullEigenAt(0, 0, k).size() : eigenAt(0, 0, k).size();
+    if (!swap.empty() && outOfCore(size, dim)) {
+        debug_print("Level " << k << " needs " << size * vectorBytes(dim)
+                    << " bytes, build out of core");
+        return new TSVQ(size,
+            [this, k, full](int begin, int count,
+                            std::vector<std::vector<uchar>> &eigens, std::vector<Color> &colors) {
+                this->eigens(k, begin, count, eigens, colors, full);
+            },
+            swap, std::max(leaf_size, int(paged_leaf_size)), mode);
     }
 
-    return new TSVQ(eigens, colors);
+    std::vector<std::vector<uchar>> eigens;
+    std::vector<Color> colors;
+    this->eigens(k, 0, size, eigens, colors, full);
+
+    return new TSVQ(std::move(eigens), std::move(colors), leaf_size, mode);
+}
+
+bool Pyramid::outOfCore(size_t size, size_t dim)
+{
+    return size * vectorBytes(dim) > in_core_bytes;
+}
+
+size_t Pyramid::vectorBytes(size_t dim)
+{
+    // Eigen and color each have a vector header and a heap block, rounded
+    // to 16 bytes plus allocator overhead. The build keeps an index per
+    // vector, leaves take the vectors over instead of copying them.
+    auto block = [](size_t bytes) { return (bytes + 15) / 16 * 16 + 16; };
+    return 2 * sizeof(std::vector<uchar>) + block(dim) + block(3) + sizeof(int);
+}
+
+void Pyramid::eigens(int k, int begin, int count,
+                     std::vector<std::vector<uchar>> &eigens, std::vector<Color> &colors,
+                     bool full) const
+{
+    int cols = _pyramid[k].cols;
+    const uchar* data = _pyramid[k].ptr<uchar>(0);
+
+    eigens.resize(count);
+    colors.resize(count);
+    for (int pos = 0; pos < count; pos++) {
+        int i = (begin + pos) / cols;
+        int j = (begin + pos) % cols;
+        int index = (begin + pos) * 3;
+        eigens[pos] = full ? fullEigenAt(i, j, k) : eigenAt(i, j, k);
+        colors[pos] = { data[index], data[index + 1], data[index + 2] };
+    }
 }
 
 std::vector<uchar> Pyramid::eigenAt(int row, int col, int k) const
@@ -75,7 +128,7 @@ std::vector<uchar> Pyramid::eigenAt(int row, int col, int k) const
         for (int j = 0; j < _neighbor; j++) {
             ret.insert(ret.end(), { data[index], data[index + 1], data[index + 2] });
             index += 3;
-            if (index > cols_3) index = 0;
+            if (index >= cols_3) index = 0;
         }
     }
     // Left
@@ -85,29 +138,87 @@ std::vector<uchar> Pyramid::eigenAt(int row, int col, int k) const
         for (int j = 0; j < half; j++) {
             ret.insert(ret.end(), { data[index], data[index + 1], data[index + 2] });
             index += 3;
-            if (index > cols_3) index = 0;
+            if (index >= cols_3) index = 0;
         }
     }
 
     // Lower resolutions
+    appendLower(ret, nw, k);
+    return ret;
+}
+
+std::vector<uchar> Pyramid::fullEigenAt(int row, int col, int k, const cv::Mat *current) const
+{
+    const cv::Mat &img = current ? *current : _pyramid[k];
+    std::vector<uchar> ret;
+    // Current resolution: the whole neighborhood
+    int half = _neighbor >> 1;
+    std::pair<int, int> nw{row - half, col - half};
+    while (nw.first < 0) nw.first += img.rows;
+    while (nw.second < 0) nw.second += img.cols;
+
+    int cols_3 = 3 * img.cols;
+    for (int i = 0; i < _neighbor; i++) {
+        const uchar* data = img.ptr<uchar>((nw.first + i) % img.rows);
+        int index = nw.second * 3;
+        for (int j = 0; j < _neighbor; j++) {
+            ret.insert(ret.end(), { data[index], data[index + 1], data[index + 2] });
+            index += 3;
+            if (index >= cols_3) index = 0;
+        }
+    }
+
+    // Lower resolutions
+    appendLower(ret, nw, k);
+    return ret;
+}
+
+void Pyramid::appendLower(std::vector<uchar> &ret, std::pair<int, int> nw, int k) const
+{
     // 6 -> 3, 5 -> 3, 4 -> 2, 3 -> 2
     int neighbor = _neighbor;
     for (int level = k + 1, n = _pyramid.size(); level < n; level++) {
         nw = {nw.first >> 1, nw.second >> 1};
         neighbor = (neighbor + 1) >> 1;
-        cols_3 = 3 * _pyramid[level].cols;
+        int cols_3 = 3 * _pyramid[level].cols;
 
         for (int i = 0; i < neighbor; i++) {
             const uchar* data = _pyramid[level].ptr<uchar>((nw.first + i) % _pyramid[level].rows);
-            int index = nw.second * 3;
+            int index = (nw.second % _pyramid[level].cols) * 3;
             for (int j = 0; j < neighbor; j++) {
                 ret.insert(ret.end(), { data[index], data[index + 1], data[index + 2] });
                 index += 3;
-                if (index > cols_3) index = 0;
+                if (index >= cols_3) index = 0;
             }
         }
     }
-    return ret;
+}
+
+void Pyramid::upsample(int k)
+{
+    cv::Mat up;
+    cv::pyrUp(_pyramid[k + 1], up, _pyramid[k].size());
+    up.copyTo(_pyramid[k]);
+}
+
+void Pyramid::correct(int k, const TSVQ *tree, int leaves)
+{
+    auto size = this->size(k);
+    for (int phase = 0; phase < 4; phase++) {
+        int dy = phase >> 1;
+        int dx = phase & 1;
+        cv::Mat current = _pyramid[k].clone();
+        cv::parallel_for_(cv::Range(0, (size.first - dy + 1) / 2),
+            [&](const cv::Range &range) {
+                for (int i = range.start; i < range.end; i++) {
+                    int row = 2 * i + dy;
+                    for (int col = dx; col < size.second; col += 2) {
+                        auto eigen = fullEigenAt(row, col, k, &current);
+                        setColor(tree->bestMatch(eigen, leaves), row, col, k);
+                    }
+                }
+            });
+    }
 }
 
 };
@@ -8,24 +8,73 @@ namespace texture {
 
 class Pyramid
 {
+public:
+    // Passes of correct() per level, twice that at the coarsest
+    constexpr static int correction_passes = 2;
+    // Smallest leaf of an out of core tree, leaves are read whole
+    constexpr static int paged_leaf_size = 256;
+
+private:
+    // Trees larger than this are built out of core
+    constexpr static size_t in_core_bytes = size_t(1) << 30;
+
 private:
     std::vector<cv::Mat> _pyramid;  // size big --> small
     int _neighbor;
 
 public:
     Pyramid(const cv::Mat& img, int k, int neighbor);
+    Pyramid(const std::vector<cv::Mat>& levels, int neighbor);
     
     std::pair<int, int> size(int k) const {
         return { _pyramid[k].rows, _pyramid[k].cols };
     }
 
+    const cv::Mat& level(int k) const { return _pyramid[k]; }
+
     void setColor(Color color, int row, int col, int k);
 
     std::vector<std::pair<int, int> > range(int row, int col, int k) const;
 
-    TSVQ* tree(int k) const;
+    // Out of core build if swap is set and the level is too large,
+    // swap is a path prefix for its files
+    TSVQ* tree(int k, const std::string &swap = "",
+               int leaf_size = TSVQ::default_leaf_size,
+               TSVQ::Split mode = TSVQ::default_split) const;
+    TSVQ* fullTree(int k, const std::string &swap = "",
+                   int leaf_size = TSVQ::default_leaf_size,
+                   TSVQ::Split mode = TSVQ::default_split) const;
+
+    // Eigens and colors of pixels [begin, begin + count) in scanline order
+    void eigens(int k, int begin, int count,
+                std::vector<std::vector<uchar>> &eigens, std::vector<Color> &colors,
+                bool full = false) const;
 
+    // Causal neighborhood: only left and above pixels at level k
     std::vector<uchar> eigenAt(int row, int col, int k) const;
+    // Whole neighborhood at level k, read from current if given
+    std::vector<uchar> fullEigenAt(int row, int col, int k,
+                                   const cv::Mat *current = nullptr) const;
+
+    // Replace level k by the upsampled level k + 1
+    void upsample(int k);
+
+    // One non causal correction pass over level k in 2 x 2 subsampled
+    // order. Pixels of one phase only read the snapshot taken before it,
+    // so they run in parallel.
+    void correct(int k, const TSVQ *tree, int leaves = 1);
+    // How far one pass of correct() spreads a change, in pixels of its level
+    int correctionReach() const { return 4 * (_neighbor >> 1); }
+
+    // Whether a tree of size vectors of dim is built out of core
+    static bool outOfCore(size_t size, size_t dim);
+    // Memory per vector during an in core build
+    static size_t vectorBytes(size_t dim);
+
+private:
+    TSVQ* buildTree(int k, const std::string &swap, bool full,
+                    int leaf_size, TSVQ::Split mode) const;
+    void appendLower(std::vector<uchar> &ret, std::pair<int, int> nw, int k) const;
 
 };
 
@@ -0,0 +1,138 @@
+#include "quilting.h"
+
+#include <algorithm>
+
+namespace texture {
+
+Quilting::Quilting(const cv::Mat& input, int patch, int overlap):
+    _input(input),
+    _patch(std::min({ patch, input.rows, input.cols })),
+    _overlap(std::max(std::min(overlap, _patch - 1), 0))
+{
+    _input.convertTo(_input_f, CV_32F);
+}
+
+cv::Size Quilting::canvasSize(int rows, int cols) const
+{
+    int ny = std::max(1, (rows - _overlap + step() - 1) / step());
+    int nx = std::max(1, (cols - _overlap + step() - 1) / step());
+    return { nx * step() + _overlap, ny * step() + _overlap };
+}
+
+void Quilting::paste(cv::Mat& canvas, int row, int col)
+{
+    bool left = col > 0 && _overlap > 0;
+    bool above = row > 0 && _overlap > 0;
+
+    cv::Point src = bestMatch(canvas, row, col, left, above);
+    cv::Mat patch = _input(cv::Rect(src.x, src.y, _patch, _patch));
+    cv::Mat mask = boundaryCut(canvas, patch, row, col, left, above);
+    patch.copyTo(canvas(cv::Rect(col, row, _patch, _patch)), mask);
+}
+
+cv::Point Quilting::bestMatch(const cv::Mat& canvas, int row, int col,
+                              bool left, bool above)
+{
+    if (!left && !above) {
+        return {
+            _rng.uniform(0, _input.cols - _patch + 1),
+            _rng.uniform(0, _input.rows - _patch + 1)
+        };
+    }
+
+    // Only the overlap with already pasted patches is compared
+    cv::Mat mask = cv::Mat::zeros(_patch, _patch, CV_32FC3);
+    if (left) mask.colRange(0, _overlap).setTo(cv::Scalar::all(1));
+    if (above) mask.rowRange(0, _overlap).setTo(cv::Scalar::all(1));
+
+    cv::Mat templ;
+    canvas(cv::Rect(col, row, _patch, _patch)).convertTo(templ, CV_32F);
+
+    // Masked SSD of every position at once,
+    // OpenCV evaluates the correlation terms with DFT
+    cv::Mat error;
+    cv::matchTemplate(_input_f, templ, error, cv::TM_SQDIFF, mask);
+
+    double min_error;
+    cv::minMaxLoc(error, &min_error);
+    double threshold = min_error + std::abs(min_error) * tolerance;
+
+    // Pick randomly among the patches within tolerance
+    std::vector<cv::Point> candidates;
+    for (int i = 0; i < error.rows; i++) {
+        const float* data = error.ptr<float>(i);
+        for (int j = 0; j < error.cols; j++) {
+            if (data[j] <= threshold) candidates.push_back({ j, i });
+        }
+    }
+    return candidates[_rng.uniform(0, (int)candidates.size())];
+}
+
+cv::Mat Quilting::boundaryCut(const cv::Mat& canvas, const cv::Mat& patch,
+                              int row, int col, bool left, bool above) const
+{
+    // 1 -- take the new patch, 0 -- keep the canvas
+    cv::Mat mask(_patch, _patch, CV_8U, cv::Scalar(1));
+    if (!left && !above) return mask;
+
+    // Squared error per pixel, summed over channels
+    cv::Mat a, b, diff, error;
+    canvas(cv::Rect(col, row, _patch, _patch)).convertTo(a, CV_32F);
+    patch.convertTo(b, CV_32F);
+    cv::subtract(a, b, diff);
+    cv::transform(diff.mul(diff), error, cv::Matx13f(1, 1, 1));
+
+    if (left) {
+        // Vertical path through the left overlap
+        std::vector<int> cut = minCut(error.colRange(0, _overlap));
+        for (int i = 0; i < _patch; i++) {
+            uchar* data = mask.ptr<uchar>(i);
+            std::fill(data, data + cut[i], 0);
+        }
+    }
+    if (above) {
+        // Horizontal path through the upper overlap
+        std::vector<int> cut = minCut(error.rowRange(0, _overlap).t());
+        for (int j = 0; j < _patch; j++) {
+            for (int i = 0; i < cut[j]; i++) {
+                mask.at<uchar>(i, j) = 0;
+            }
+        }
+    }
+    return mask;
+}
+
+std::vector<int> Quilting::minCut(const cv::Mat& error)
+{
+    int rows = error.rows;
+    int cols = error.cols;
+
+    // Accumulate minimal cost from top to bottom
+    cv::Mat cost = error.clone();
+    for (int i = 1; i < rows; i++) {
+        const float* prev = cost.ptr<float>(i - 1);
+        float* data = cost.ptr<float>(i);
+        for (int j = 0; j < cols; j++) {
+            float best = prev[j];
+            if (j > 0) best = std::min(best, prev[j - 1]);
+            if (j + 1 < cols) best = std::min(best, prev[j + 1]);
+            data[j] += best;
+        }
+    }
+
+    // Trace back the path, one column index per row
+    std::vector<int> cut(rows);
+    const float* last = cost.ptr<float>(rows - 1);
+    cut[rows - 1] = int(std::min_element(last, last + cols) - last);
+    for (int i = rows - 2; i >= 0; i--) {
+        const float* data = cost.ptr<float>(i);
+        int j = cut[i + 1];
+        int best = j;
+        if (j > 0 && data[j - 1] < data[best]) best = j - 1;
+        if (j + 1 < cols && data[j + 1] < data[best]) best = j + 1;
+        cut[i] = best;
+    }
+    return cut;
+}
+
+};
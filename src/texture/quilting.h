@@ -0,0 +1,46 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+namespace texture {
+
+// Patch-based synthesis (Efros & Freeman, "Image Quilting")
+class Quilting
+{
+private:
+    constexpr static double tolerance = 0.1;
+
+private:
+    cv::Mat _input;     // exemplar, 8 bit
+    cv::Mat _input_f;   // exemplar, float, for overlap search
+    int _patch;
+    int _overlap;
+    cv::RNG _rng;
+
+public:
+    Quilting(const cv::Mat& input, int patch, int overlap);
+
+    // Patches scale with the neighborhood, overlapping by 1/6
+    static int patchSize(int neighbor) { return neighbor * 4; }
+    static int overlapSize(int patch) { return patch / 6; }
+
+    int patch() const { return _patch; }
+    int step() const { return _patch - _overlap; }
+
+    // Canvas covering rows x cols with a whole number of patches
+    cv::Size canvasSize(int rows, int cols) const;
+
+    // Paste the best fitting patch with its top-left corner at (row, col)
+    void paste(cv::Mat& canvas, int row, int col);
+
+private:
+    cv::Point bestMatch(const cv::Mat& canvas, int row, int col, bool left, bool above);
+    cv::Mat boundaryCut(const cv::Mat& canvas, const cv::Mat& patch,
+                        int row, int col, bool left, bool above) const;
+
+    static std::vector<int> minCut(const cv::Mat& error);
+};
+
+};
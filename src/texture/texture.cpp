@@ -1,73 +1,267 @@
 #include "texture.h"
 #include <texture/pyramid.h>
+#include <texture/quilting.h>
 
 #include <ui/TexSyn.h>
 
+#include <QDir>
+#include <QDirIterator>
+
 #include <map>
 #include <chrono>
 
 namespace texture {
 
+using std::chrono::system_clock;
+
+static double secondsSince(system_clock::time_point startTime)
+{
+    using std::chrono::microseconds;
+    auto endTime = system_clock::now();
+    auto duration = std::chrono::duration_cast<microseconds>(endTime - startTime);
+    return double(duration.count()) * microseconds::period::num / microseconds::period::den;
+}
+
+Worker::Worker() :
+    _swap_dir(QDir::temp().filePath("texsyn_swap_XXXXXX")),
+    _swap_lock(_swap_dir.filePath("lock")),
+    _swap_count(0)
+{
+    _swap_lock.lock();
+    removeStaleSwap();
+}
+
+void Worker::clearSwap()
+{
+    // The leaked tree can't be deleted, pool threads of its
+    // cv::parallel_for_ may still be reading it
+    QDir dir(_swap_dir.path());
+    for (const QString &name : dir.entryList({ "run*" }, QDir::Files)) {
+        dir.remove(name);
+    }
+}
+
+std::string Worker::swapPath()
+{
+    // Every run gets its own prefix, files of a terminated one may linger
+    return _swap_dir.filePath(QString("run%1").arg(_swap_count++)).toStdString();
+}
+
+void Worker::removeStaleSwap()
+{
+    QDirIterator it(QDir::tempPath(), { "texsyn_swap_*" }, QDir::Dirs);
+    while (it.hasNext()) {
+        QDir dir(it.next());
+        // Locks of processes that are gone count as stale
+        QLockFile lock(dir.filePath("lock"));
+        lock.setStaleLockTime(0);
+        if (!lock.tryLock(0)) continue;
+        lock.unlock();
+        debug_print("Removing stale swap " << dir.path().toStdString());
+        dir.removeRecursively();
+    }
+}
+
 void Worker::synthesize(const cv::Mat *pInput, int rows, int cols,
-                        int levels, int neighbor)
+                        int levels, int neighbor, int method, int budget_ms)
 {
     const cv::Mat &input = *pInput;
-    // Record running time
-    using std::chrono::system_clock;
-    using std::chrono::microseconds;
     // Start to record time
     auto startTime = system_clock::now();
-    {
-        // Initialize
-        cv::Mat output = initialize(rows, cols, input);
-        emit updateResult(&output);
-
-        // Build pyramid
-        Pyramid pyramid_in(input, levels, neighbor);
-        Pyramid pyramid_out(output, levels, neighbor);
-
-        // Loop for each level
-        while (levels--) {
-            emit showResulotion(levels);
-
-            // Accelerate -- Build TSVQ struct for this level
-            TSVQ *tree = pyramid_in.tree(levels);
-            debug_print("Built TSVQ at level " << levels);
-
-            // Loop for each pixel in this level
-            auto size = pyramid_out.size(levels);
-            for (int row = 0; row < size.first; row++) {
-                for (int col = 0; col < size.second; col++) {
-                    // Search best pixel color
-                    auto eigen = pyramid_out.eigenAt(row, col, levels);
-                    auto color = tree->bestMatch(eigen);
-                    // Set output pixel
-                    pyramid_out.setColor(color, row, col, levels);
-                    // Set UI pixel 
-                    for (auto p : pyramid_out.range(row, col, levels)) {
-                        emit updateResultPixel(
-                            p.first, p.second, color[0], color[1], color[2]);
-                    }
-                }
-            }
 
-            delete tree;
-        }
+    // Fit parameters into the time budget
+    Plan plan = budget_ms > 0 ?
+        _planner.plan(method, input.rows, input.cols, rows, cols,
+                      levels, neighbor, budget_ms * 0.001) :
+        _planner.fixed(method, levels, neighbor);
+    debug_print("Plan: method " << plan.method << ", levels " << plan.levels
+                << ", neighbor " << plan.neighbor);
+
+    switch (plan.method) {
+    case PATCH_QUILTING:
+        synthesizeQuilting(input, rows, cols, plan.neighbor);
+        _planner.recordQuilting(plan.neighbor, input.rows, input.cols,
+                                rows, cols, secondsSince(startTime));
+        break;
+    case PIXEL_PARALLEL:
+        synthesizeParallel(input, rows, cols, plan);
+        break;
+    case PIXEL_TSVQ:
+    default:
+        synthesizeTSVQ(input, rows, cols, plan);
+        break;
     }
     // End to record time
-    auto endTime = system_clock::now();
-    auto duration = std::chrono::duration_cast<microseconds>(endTime - startTime);
-    double s = double(duration.count()) * microseconds::period::num / microseconds::period::den;
-    emit showRunningTime(s);
+    emit showRunningTime(secondsSince(startTime));
     
 }
 
-cv::Mat initialize(int rows, int cols, const cv::Mat& input) 
+void Worker::synthesizeTSVQ(const cv::Mat &input, int rows, int cols, Plan &plan)
+{
+    auto startTime = system_clock::now();
+    int levels = plan.levels;
+
+    // Initialize
+    cv::Mat output = initialize(rows, cols, input);
+    emit updateResult(&output);
+
+    // Large levels swap their TSVQ leaves to here
+    std::string swap = swapPath();
+
+    // Build pyramid
+    Pyramid pyramid_in(input, levels, plan.neighbor);
+    Pyramid pyramid_out(output, levels, plan.neighbor);
+    _planner.recordSetup(rows, cols, secondsSince(startTime));
+
+    // Loop for each level
+    while (levels--) {
+        emit showResulotion(levels);
+
+        // Dropped to fit the budget -- only the final result is shown
+        int leaves = plan.leaves[levels];
+        if (leaves == 0) {
+            pyramid_out.upsample(levels);
+            if (levels == 0) showRows(pyramid_out, 0, 0, rows);
+            continue;
+        }
+
+        // Accelerate -- Build TSVQ struct for this level
+        auto buildTime = system_clock::now();
+        TSVQ *tree = pyramid_in.tree(levels, swap, plan.leaf_size, plan.split);
+        _planner.recordBuild(levels, plan, input.rows, input.cols,
+                             tree->outOfCore(), secondsSince(buildTime));
+        debug_print("Built TSVQ at level " << levels);
+
+        // Loop for each pixel in this level, timing search and UI apart
+        double searchTime = 0;
+        double showTime = 0;
+        auto size = pyramid_out.size(levels);
+        for (int row = 0; row < size.first; row++) {
+            auto rowTime = system_clock::now();
+            for (int col = 0; col < size.second; col++) {
+                // Search best pixel color
+                auto eigen = pyramid_out.eigenAt(row, col, levels);
+                auto color = tree->bestMatch(eigen, leaves);
+                // Set output pixel
+                pyramid_out.setColor(color, row, col, levels);
+            }
+            searchTime += secondsSince(rowTime);
+
+            // Set UI pixels
+            rowTime = system_clock::now();
+            showRows(pyramid_out, levels, row, row + 1);
+            showTime += secondsSince(rowTime);
+        }
+        _planner.recordSearch(levels, plan, input.rows, input.cols, rows, cols,
+                              searchTime);
+        _planner.recordShow(rows, cols, showTime);
+
+        delete tree;
+
+        // Cut search effort if this level ran over
+        _planner.adjust(plan, levels, secondsSince(startTime),
+                        input.rows, input.cols, rows, cols);
+    }
+}
+
+void Worker::synthesizeParallel(const cv::Mat &input, int rows, int cols, Plan &plan)
+{
+    int levels = plan.levels;
+
+    // Initialize
+    cv::Mat output = initialize(rows, cols, input);
+    emit updateResult(&output);
+
+    // Large levels swap their TSVQ leaves to here
+    std::string swap = swapPath();
+
+    // Build pyramid
+    Pyramid pyramid_in(input, levels, plan.neighbor);
+    Pyramid pyramid_out(output, levels, plan.neighbor);
+
+    // Loop for each level
+    while (levels--) {
+        emit showResulotion(levels);
+
+        // Start from the coarser result, the coarsest level from noise
+        bool coarsest = levels == plan.levels - 1;
+        if (!coarsest) pyramid_out.upsample(levels);
+
+        // Accelerate -- Build TSVQ struct of full neighborhoods
+        TSVQ *tree = pyramid_in.fullTree(levels, swap, plan.leaf_size, plan.split);
+        debug_print("Built full TSVQ at level " << levels);
+
+        // Correction passes, each one in parallel
+        int leaves = plan.leaves[levels];
+        int passes = coarsest ? 2 * Pyramid::correction_passes : Pyramid::correction_passes;
+        for (int pass = 0; pass < passes; pass++) {
+            pyramid_out.correct(levels, tree, leaves);
+        }
+
+        delete tree;
+
+        // Set UI pixels
+        showRows(pyramid_out, levels, 0, pyramid_out.size(levels).first);
+    }
+}
+
+void Worker::showRows(const Pyramid &pyramid, int k, int begin, int end)
+{
+    const cv::Mat &level = pyramid.level(k);
+    for (int row = begin; row < end; row++) {
+        const uchar *data = level.ptr<uchar>(row);
+        for (int col = 0; col < level.cols; col++) {
+            for (auto p : pyramid.range(row, col, k)) {
+                emit updateResultPixel(
+                    p.first, p.second, data[0], data[1], data[2]);
+            }
+            data += 3;
+        }
+    }
+}
+
+void Worker::synthesizeQuilting(const cv::Mat &input, int rows, int cols,
+                                int neighbor)
+{
+    // Initialize
+    cv::Mat output = initialize(rows, cols, input);
+    emit updateResult(&output);
+    emit showResulotion(0);
+
+    int patch = Quilting::patchSize(neighbor);
+    Quilting quilting(input, patch, Quilting::overlapSize(patch));
+    debug_print("Quilting with patch " << quilting.patch());
+
+    // Patches hang over the border, only rows x cols are shown
+    cv::Mat canvas = cv::Mat::zeros(quilting.canvasSize(rows, cols), input.type());
+    int patch_size = quilting.patch();
+    int step = quilting.step();
+    for (int y = 0; y + patch_size <= canvas.rows; y += step) {
+        // Loop for each patch in this band
+        for (int x = 0; x + patch_size <= canvas.cols; x += step) {
+            quilting.paste(canvas, y, x);
+        }
+
+        // Rows above the next band's overlap are final, set UI pixels
+        bool last = y + step + patch_size > canvas.rows;
+        int end = last ? rows : std::min(y + step, rows);
+        for (int row = y; row < end; row++) {
+            const uchar *data = canvas.ptr<uchar>(row);
+            for (int col = 0; col < cols; col++) {
+                emit updateResultPixel(
+                    row, col, data[0], data[1], data[2]);
+                data += 3;
+            }
+        }
+    }
+}
+
+cv::Mat initialize(int rows, int cols, const cv::Mat& input, uint64_t seed)
 {
     cv::Mat output = cv::Mat::zeros(rows, cols, input.type());
 
     // Gaussian white noise
-    cv::RNG rng;
+    cv::RNG rng(seed);
     uchar* data = output.ptr<uchar>(0);
     for (int i = 0, n = rows * cols * output.channels(); i < n; i++) {
         int color = 127 + rng.gaussian(1.2) * 32;
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
 #include <vector>
+#include <QLockFile>
 #include <QObject>
+#include <QTemporaryDir>
+
+#include <texture/planner.h>
 
 namespace cv {
 class Mat;
@@ -11,11 +16,21 @@ class TexSyn;
 
 namespace texture {
 
+class Pyramid;
+
 inline int clamp(int num, int a, int b) {
     return std::min(std::max(num, a), b);
 }
 
-cv::Mat initialize(int rows, int cols, const cv::Mat& input);
+// Synthesis engines, selectable in Worker::synthesize
+enum Method {
+    PIXEL_TSVQ = 0,         // per pixel search with TSVQ
+    PATCH_QUILTING = 1,     // patch based image quilting
+    PIXEL_PARALLEL = 2,     // non causal correction passes, in parallel
+};
+
+cv::Mat initialize(int rows, int cols, const cv::Mat& input,
+                   uint64_t seed = 0xFFFFFFFF);
 
 void matchHistogram(cv::Mat& output, const cv::Mat& input);
 std::vector<double> makeCDF(const cv::Mat& img);
@@ -25,15 +40,44 @@ class Worker : public QObject
 {
     Q_OBJECT
 
+public:
+    Worker();
+
+    // Remove swap files left by a terminated synthesis. Best effort: its
+    // leaked TSVQ keeps the pages file open, which Windows won't delete.
+    // Such files go with the directory at exit or at the next startup.
+    void clearSwap();
+
 public slots:
     void synthesize(const cv::Mat *pInput, int rows, int cols,
-                    int levels, int neighbor_size);
+                    int levels, int neighbor_size, int method, int budget_ms);
 
 signals:
     void updateResult(const cv::Mat* res);
     void updateResultPixel(int row, int col, uchar r, uchar g, uchar b);
     void showResulotion(int k);
     void showRunningTime(double s);
+
+private:
+    Planner _planner;   // keeps timing history across runs
+
+    // Swap files of out of core TSVQ builds. The lock marks the
+    // directory as in use, directories of dead processes are removed.
+    QTemporaryDir _swap_dir;
+    QLockFile _swap_lock;
+    int _swap_count;
+
+private:
+    std::string swapPath();
+    static void removeStaleSwap();
+
+    // Send rows [begin, end) of level k to the UI, scaled to full size
+    void showRows(const Pyramid &pyramid, int k, int begin, int end);
+
+    void synthesizeTSVQ(const cv::Mat &input, int rows, int cols, Plan &plan);
+    void synthesizeParallel(const cv::Mat &input, int rows, int cols, Plan &plan);
+    void synthesizeQuilting(const cv::Mat &input, int rows, int cols,
+                            int neighbor);
 };
 
 };
\ No newline at end of file
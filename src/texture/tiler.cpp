@@ -0,0 +1,199 @@
+#include "tiler.h"
+#include <texture/texture.h>
+
+namespace texture {
+
+namespace {
+
+inline int floorDiv(int a, int b) {
+    return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+inline int roundUp(int a, int b) {
+    return (a + b - 1) / b * b;
+}
+
+// SplitMix64 finalizer
+inline uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+};
+
+Tiler::Tiler(const cv::Mat& input, int levels, int neighbor,
+             int tile, size_t capacity, uint64_t seed):
+    _pyramid_in(input, levels, neighbor),
+    _trees(levels),
+    _levels(levels),
+    _neighbor(neighbor),
+    _seed(seed),
+    _capacity(capacity),
+    _used(0)
+{
+    // Window origins must map exactly onto every coarser level and keep
+    // the parity of the correction phases
+    int unit = std::max(2, 1 << (levels - 1));
+    _tile = roundUp(std::max(tile, 1), unit);
+
+    // Wrapped neighborhoods and the upsampling border spoil the outer
+    // neighbor + unit pixels of a window, every pass carries that inward
+    _margin = neighbor + unit + passes(levels - 1) * _pyramid_in.correctionReach();
+    _apron = roundUp(_margin + 1, unit);
+
+    for (int k = 0; k < levels; k++) {
+        _trees[k] = _pyramid_in.fullTree(k);
+        debug_print("Built full TSVQ at level " << k);
+    }
+}
+
+Tiler::~Tiler()
+{
+    for (TSVQ *tree : _trees) delete tree;
+}
+
+void Tiler::clearCache()
+{
+    _cache.clear();
+    _index.clear();
+    _used = 0;
+}
+
+cv::Mat Tiler::tile(int tile_x, int tile_y, int k)
+{
+    Key key{ k, tile_y, tile_x };
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        // Hit -- mark as most recent
+        _cache.splice(_cache.begin(), _cache, it->second);
+        return it->second->second;
+    }
+
+    cv::Mat ret = synthesize(tile_x, tile_y, k);
+    insert(key, ret);
+    return ret;
+}
+
+cv::Mat Tiler::synthesize(int tile_x, int tile_y, int k)
+{
+    // Window around the tile
+    int row = tile_y * _tile - _apron;
+    int col = tile_x * _tile - _apron;
+    int size = _tile + 2 * _apron;
+
+    // Coarser levels of the window come from parent tiles
+    std::vector<cv::Mat> levels(1);
+    for (int level = k + 1; level < _levels; level++) {
+        int scale = 1 << (level - k);
+        levels.push_back(
+            stitch(row / scale, col / scale, size / scale, size / scale,
+                   [&](int x, int y) { return tile(x, y, level); }));
+    }
+    // Start from noise at the coarsest level, from the parents otherwise
+    if (k == _levels - 1) {
+        levels[0] = stitch(row, col, size, size,
+                           [&](int x, int y) { return noise(x, y, k); });
+    } else {
+        cv::pyrUp(levels[1], levels[0], cv::Size(size, size));
+    }
+
+    Pyramid window(levels, _neighbor);
+    for (int pass = 0, n = passes(k); pass < n; pass++) {
+        window.correct(0, _trees[k]);
+    }
+    debug_print("Synthesized tile (" << tile_x << ", " << tile_y << ") at level " << k);
+    _ASSERT(bordersAgree(window.level(0), row, col, k));
+
+    return window.level(0)(cv::Rect(_apron, _apron, _tile, _tile)).clone();
+}
+
+int Tiler::passes(int k) const
+{
+    return k == _levels - 1 ?
+        2 * Pyramid::correction_passes : Pyramid::correction_passes;
+}
+
+bool Tiler::bordersAgree(const cv::Mat& window, int row, int col, int k) const
+{
+    // Exact part of the window, in pixels of level k
+    cv::Rect exact(col + _margin, row + _margin,
+                   window.cols - 2 * _margin, window.rows - 2 * _margin);
+
+    int tile_y = (row + _apron) / _tile;
+    int tile_x = (col + _apron) / _tile;
+    for (int y = tile_y - 1; y <= tile_y + 1; y++) {
+        for (int x = tile_x - 1; x <= tile_x + 1; x++) {
+            auto it = _index.find(Key{ k, y, x });
+            if (it == _index.end() || (x == tile_x && y == tile_y)) continue;
+
+            cv::Rect shared = exact & cv::Rect(x * _tile, y * _tile, _tile, _tile);
+            if (shared.area() == 0) continue;
+            const cv::Mat &neighbour = it->second->second;
+            cv::Mat a = window(shared - cv::Point(col, row));
+            cv::Mat b = neighbour(shared - cv::Point(x * _tile, y * _tile));
+            if (cv::norm(a, b, cv::NORM_INF) != 0) {
+                debug_print("Tile (" << tile_x << ", " << tile_y << ") at level " << k
+                            << " disagrees with tile (" << x << ", " << y << ")");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+cv::Mat Tiler::noise(int tile_x, int tile_y, int k) const
+{
+    return initialize(_tile, _tile, _pyramid_in.level(k), seed(tile_x, tile_y, k));
+}
+
+uint64_t Tiler::seed(int tile_x, int tile_y, int k) const
+{
+    uint64_t h = mix(_seed + uint64_t(k));
+    h = mix(h ^ uint64_t(uint32_t(tile_x)));
+    h = mix(h ^ uint64_t(uint32_t(tile_y)));
+    return h;
+}
+
+cv::Mat Tiler::stitch(int row, int col, int rows, int cols,
+                      const std::function<cv::Mat(int, int)>& fetch) const
+{
+    cv::Mat ret(rows, cols, _pyramid_in.level(0).type());
+
+    int y0 = floorDiv(row, _tile), y1 = floorDiv(row + rows - 1, _tile);
+    int x0 = floorDiv(col, _tile), x1 = floorDiv(col + cols - 1, _tile);
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            cv::Mat src = fetch(x, y);
+
+            // Intersection of the tile and the region
+            int top = std::max(row, y * _tile);
+            int bottom = std::min(row + rows, (y + 1) * _tile);
+            int left = std::max(col, x * _tile);
+            int right = std::min(col + cols, (x + 1) * _tile);
+            cv::Size size(right - left, bottom - top);
+
+            src(cv::Rect(cv::Point(left - x * _tile, top - y * _tile), size))
+                .copyTo(ret(cv::Rect(cv::Point(left - col, top - row), size)));
+        }
+    }
+    return ret;
+}
+
+void Tiler::insert(const Key& key, const cv::Mat& tile)
+{
+    _cache.emplace_front(key, tile);
+    _index[key] = _cache.begin();
+    _used += tile.total() * tile.elemSize();
+
+    // Evict least recently used tiles, but always keep the newest one
+    while (_used > _capacity && _cache.size() > 1) {
+        const auto &last = _cache.back();
+        _used -= last.second.total() * last.second.elemSize();
+        _index.erase(last.first);
+        _cache.pop_back();
+    }
+}
+
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <texture/pyramid.h>
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <tuple>
+
+namespace texture {
+
+// Random access to tiles of an unbounded synthesized texture.
+//
+// Tile (x, y) at level k covers the pixels [y * tile, (y + 1) * tile) x
+// [x * tile, (x + 1) * tile) of that level. Each level is defined over the
+// whole plane: the coarsest starts from noise seeded per (k, x, y), finer
+// ones from the upsampled coarser level, then every level runs non causal
+// correction passes (Pyramid::correct). A pixel thus depends only on a
+// bounded region around it, and a tile is computed inside a window whose
+// apron covers that region, so neighbouring tiles agree along their
+// borders whatever order they are requested in. Tiles of every level
+// share one LRU cache bounded in bytes.
+//
+// Not thread safe.
+class Tiler
+{
+private:
+    typedef std::tuple<int, int, int> Key;    // level, tile_y, tile_x
+    typedef std::list<std::pair<Key, cv::Mat>> Cache;
+
+private:
+    Pyramid _pyramid_in;
+    std::vector<TSVQ*> _trees;
+
+    int _levels;
+    int _neighbor;
+    int _tile;
+    int _apron;
+    int _margin;        // pixels of a window that may differ from the plane
+    uint64_t _seed;
+
+    size_t _capacity;   // in bytes
+    size_t _used;
+    Cache _cache;       // most recent first
+    std::map<Key, Cache::iterator> _index;
+
+public:
+    Tiler(const cv::Mat& input, int levels, int neighbor,
+          int tile, size_t capacity, uint64_t seed = 0);
+    ~Tiler();
+
+    Tiler(const Tiler&) = delete;
+    Tiler& operator=(const Tiler&) = delete;
+
+    // Tile size, rounded up so that every level stays aligned
+    int tileSize() const { return _tile; }
+
+    // Finest level tile (tile_x, tile_y), tileSize() x tileSize()
+    cv::Mat tile(int tile_x, int tile_y) { return tile(tile_x, tile_y, 0).clone(); }
+
+    size_t cacheSize() const { return _used; }
+    void clearCache();
+
+private:
+    cv::Mat tile(int tile_x, int tile_y, int k);
+    cv::Mat synthesize(int tile_x, int tile_y, int k);
+    int passes(int k) const;
+
+    // Whether the window at (row, col) matches cached neighbouring tiles
+    // where both are exact
+    bool bordersAgree(const cv::Mat& window, int row, int col, int k) const;
+
+    cv::Mat noise(int tile_x, int tile_y, int k) const;
+    uint64_t seed(int tile_x, int tile_y, int k) const;
+
+    // rows x cols pixels of level k starting at (row, col), stitched by tiles
+    cv::Mat stitch(int row, int col, int rows, int cols,
+                   const std::function<cv::Mat(int, int)>& fetch) const;
+
+    void insert(const Key& key, const cv::Mat& tile);
+};
+
+};
@@ -17,11 +17,14 @@ TexSyn::TexSyn(QWidget *parent)
     ui.heightEdit->setValidator(validator);
     ui.kLevelEdit->setValidator(validator);
     ui.neighborEdit->setValidator(validator);
+    ui.budgetEdit->setValidator(new QIntValidator(0, 99999, this));
 
     connect(ui.loadButton, SIGNAL(clicked(bool)), this, SLOT(loadImg()));
     connect(ui.saveButton, SIGNAL(clicked(bool)), this, SLOT(saveImg()));
     connect(ui.runButton,  SIGNAL(clicked(bool)), this, SLOT(run()));
     connect(ui.stopButton, SIGNAL(clicked(bool)), this, SLOT(stop()));
+    connect(ui.methodBox,  SIGNAL(currentIndexChanged(int)), this, SLOT(methodChanged(int)));
+    methodChanged(ui.methodBox->currentIndex());
 
     reset();
 
@@ -102,12 +105,14 @@ void TexSyn::run()
     int height = clamp(ui.heightEdit, _example.cols, ui.result->width());
     int kLevel = clamp(ui.kLevelEdit, 1, 5);
     int neighbor = clamp(ui.neighborEdit, 3, 13);
+    int method = ui.methodBox->currentIndex();
+    int budget = ui.budgetEdit->isEnabled() ? clamp(ui.budgetEdit, 0, 99999) : 0;
     
     ui.result->clear();
     _result_qt = QImage(width, height, QImage::Format_RGB888);
 
     // Core function, running in a worker thread
-    emit synthesize(&_example, height, width, kLevel, neighbor);
+    emit synthesize(&_example, height, width, kLevel, neighbor, method, budget);
 }
 
 void TexSyn::stop()
@@ -115,6 +120,7 @@ void TexSyn::stop()
     // Restart worker thread
     _workerThread.terminate();
     _workerThread.wait();
+    _worker->clearSwap();
 
     _workerThread.start();
 
@@ -122,6 +128,12 @@ void TexSyn::stop()
     ui.result->setPixmap(QPixmap::fromImage(_result_qt));
 }
 
+void TexSyn::methodChanged(int method)
+{
+    // Only TSVQ synthesis is planned against a time budget
+    ui.budgetEdit->setEnabled(method == texture::PIXEL_TSVQ);
+}
+
 void TexSyn::updateResult(const cv::Mat* res)
 {
     _result_qt = cvMatToQImage(*res);
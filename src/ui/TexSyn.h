@@ -21,7 +21,7 @@ public:
 
 signals:
     void synthesize(const cv::Mat* pInput, int rows, int cols,
-                    int levels, int neighbor_size);
+                    int levels, int neighbor_size, int method, int budget_ms);
 
 public slots:
     void updateResult(const cv::Mat* res);
@@ -34,6 +34,7 @@ private slots:
     void saveImg();
     void run();
     void stop();
+    void methodChanged(int method);
 
 private:
     Ui::TexSynClass ui;
@@ -53,6 +54,7 @@ private:
 
         ui.kLevelEdit->setText("1");
         ui.neighborEdit->setText("5");
+        ui.budgetEdit->setText("0");
         ui.infoLabel->setText("");
     }
 